@@ -0,0 +1,421 @@
+"""
+Loopback test for the serial receiver, no DOS machine needed.
+
+Plays the DISKDUMP side of the serial protocol over a pseudo-terminal pair,
+with the same chunks, frames, windows and timeouts as SERIAL.C, and runs
+main.py on the other end. The pty only lets bytes through as fast as the
+line would, and bit errors can be thrown into the data on its way to the
+receiver. At the end the received image is compared with what was sent,
+and the throughput is printed against the line rate.
+
+    python loopback.py --size 1048576 --ber 1e-5
+    python loopback.py --ports 2
+
+Only works where there are ptys (Linux, macOS...).
+"""
+import argparse
+import binascii
+import hashlib
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import tty
+
+# Constants, see SERIAL.H
+HEADER_MAGIC = b"DISKDUMP"
+ACK = 0x55
+NACK = 0xAA
+ABRT = 0xCC
+
+PROTO_STOP_AND_WAIT = 0
+PROTO_WINDOWED = 1
+PROTO_STRIPED = 2
+PROTO_SHIFT = 4
+LINK_SHIFT = 4
+MAX_SERIAL_PORTS = 2
+
+HASH_MD5 = 1
+FRAME_SIZE = 2048
+REPLY_LENGTH = 5  # ACK/NACK + packet index
+HEADER_REPLY_LENGTH = 2  # ACK/NACK + peer window
+MAX_WINDOW = 32
+DEFAULT_WINDOW = 16
+SECTOR_SIZE = 512
+CHUNK_SECTORS = 127  # What an LBA read gets at once
+BITS_PER_BYTE_SERIAL = 10  # 8N1
+REPLY_TIMEOUT = 3  # TICKS_PER_SEC * MAX_RETRIES_SERIAL
+MAX_RETRIES = 3
+TICK = 0.01
+
+SPEEDS = {
+    1200: 0,
+    2400: 1,
+    4800: 2,
+    9600: 3,
+    19200: 4,
+    38400: 5,
+    57600: 6,
+    115200: 7,
+}
+
+RECEIVER = os.path.join(os.path.dirname(os.path.abspath(__file__)), "main.py")
+
+
+class Line:
+    # The DISKDUMP end of a pty. Whatever is written goes out at the line
+    # rate from a thread of its own, like the ISR draining the TX queue.
+    def __init__(self, speed: int, ber: float):
+        self.fd, slave = os.openpty()
+        tty.setraw(self.fd)
+        self.device = os.ttyname(slave)
+        os.close(slave)
+        self.bytesPerTick = max(1, int(speed / BITS_PER_BYTE_SERIAL * TICK))
+        self.ber = ber
+        self.noisy = False
+        self.bitErrors = 0
+        self.txQueue = bytearray()
+        self.rxQueue = bytearray()
+        self.lock = threading.Lock()
+        threading.Thread(target=self.transmit, daemon=True).start()
+        threading.Thread(target=self.receive, daemon=True).start()
+
+    def transmit(self) -> None:
+        nextTick = time.monotonic()
+        while True:
+            with self.lock:
+                data = bytearray(self.txQueue[:self.bytesPerTick])
+                del self.txQueue[:len(data)]
+                noisy = self.noisy
+            if data and noisy:
+                self.addNoise(data)
+            if data:
+                os.write(self.fd, data)
+            nextTick += TICK
+            time.sleep(max(0, nextTick - time.monotonic()))
+
+    def addNoise(self, data: bytearray) -> None:
+        for i in range(len(data)):
+            for bit in range(8):
+                if random.random() < self.ber:
+                    data[i] ^= 1 << bit
+                    self.bitErrors += 1
+
+    def receive(self) -> None:
+        while True:
+            try:
+                data = os.read(self.fd, 256)
+            except OSError:
+                # Nobody has the other end open, while the receiver
+                # reopens it at the new speed
+                time.sleep(TICK)
+                continue
+            with self.lock:
+                self.rxQueue += data
+
+    def write(self, data: bytes) -> None:
+        with self.lock:
+            self.txQueue += data
+
+    def busy(self) -> bool:
+        with self.lock:
+            return len(self.txQueue) != 0
+
+    def drain(self) -> None:
+        while self.busy():
+            time.sleep(TICK)
+
+    def recv(self):
+        with self.lock:
+            if not self.rxQueue:
+                return None
+            data = self.rxQueue[0]
+            del self.rxQueue[0]
+            return data
+
+    def recvExact(self, length: int, timeout: float = REPLY_TIMEOUT) -> bytes:
+        deadline = time.monotonic() + timeout
+        data = bytearray()
+        while len(data) < length and time.monotonic() < deadline:
+            b = self.recv()
+            if b is None:
+                time.sleep(TICK)
+            else:
+                data.append(b)
+        return bytes(data)
+
+
+class Link:
+    # Windowed state for one port, serial_link in SERIAL.H
+    def __init__(self, line: Line):
+        self.line = line
+        self.end = 0
+        self.winBase = 0
+        self.winNext = 0
+        self.retries = [0] * MAX_WINDOW  # NACKs for each frame slot
+        self.timeouts = 0
+        self.waitStart = 0
+        self.reply = bytearray()
+
+
+class Sender:
+    def __init__(self, lines: list, speed: int, window: int, image: bytes):
+        self.links = [Link(line) for line in lines]
+        self.speed = speed
+        self.window = min(window, MAX_WINDOW)
+        self.image = image
+        self.protocol = PROTO_WINDOWED if self.window else PROTO_STOP_AND_WAIT
+        if self.window and len(self.links) > 1:
+            self.protocol = PROTO_STRIPED
+        self.packetIndex = 0
+        self.nacks = 0
+        self.retransmissions = 0
+        self.startSector = 0
+
+    def log(self, message: str) -> None:
+        print(f"[DISKDUMP] {message}", flush=True)
+
+    def handshake(self) -> bool:
+        line = self.links[0].line
+        header = HEADER_MAGIC + bytes([SPEEDS[self.speed] | (self.protocol << PROTO_SHIFT)])
+        if self.protocol != PROTO_STOP_AND_WAIT:
+            # Every port gets the header, so the peer can tell which link is which
+            for i, l in enumerate(self.links):
+                linkByte = bytes([i | (len(self.links) << LINK_SHIFT)]) if self.protocol == PROTO_STRIPED else b''
+                l.line.write(header + linkByte)
+            for l in self.links:
+                reply = l.line.recvExact(HEADER_REPLY_LENGTH)
+                if len(reply) != HEADER_REPLY_LENGTH or reply[0] != ACK or reply[1] == 0:
+                    break
+                self.window = min(self.window, reply[1])
+            else:
+                reply = None
+            if reply is not None:
+                if len(self.links) > 1:
+                    self.log("Peer doesn't support windowed transfers, which are needed to use more than one port")
+                    return False
+                self.log("Peer doesn't support windowed transfers, falling back to stop-and-wait")
+                self.protocol = PROTO_STOP_AND_WAIT
+                self.window = 0
+        if self.protocol == PROTO_STOP_AND_WAIT:
+            line.write(HEADER_MAGIC + bytes([SPEEDS[self.speed]]))
+
+        # The receiver reopens the ports at the new speed and waits 3s
+        for l in self.links:
+            l.line.drain()
+            if l.line.recvExact(1, 10) != bytes([ACK]):
+                self.log("Peer failed to acknowledge speed negotiation")
+                return False
+
+        numSectors = len(self.image) // SECTOR_SIZE
+        line.write(struct.pack('<IIIHI', 0, 0, 0, SECTOR_SIZE, numSectors))
+        if self.protocol != PROTO_STOP_AND_WAIT:
+            line.write(struct.pack('<BHB', self.window, FRAME_SIZE, 0))
+            reply = line.recvExact(REPLY_LENGTH, 10)
+            if len(reply) != REPLY_LENGTH or reply[0] != ACK:
+                self.log("Peer failed to acknowledge disk info")
+                return False
+            self.startSector = struct.unpack_from('<I', reply, 1)[0]
+        elif line.recvExact(1, 10) != bytes([ACK]):
+            self.log("Peer failed to acknowledge disk info")
+            return False
+        self.log(f"Sending {len(self.image)} bytes at {len(self.links)} x {self.speed} bps, " + (f"window of {self.window}" if self.window else "stop-and-wait"))
+        return True
+
+    # -- Stop-and-wait --
+
+    def sendChunk(self, chunk: bytes) -> bool:
+        line = self.links[0].line
+        for retry in range(MAX_RETRIES):
+            line.write(struct.pack('<II', self.packetIndex, len(chunk)) + chunk + struct.pack('<I', binascii.crc32(chunk)))
+            line.drain()
+            reply = line.recvExact(1)
+            if reply == bytes([ACK]):
+                self.packetIndex += 1
+                return True
+            if reply == bytes([ABRT]):
+                self.log("Peer aborted the transfer")
+                return False
+            self.nacks += 1
+            self.retransmissions += 1
+        self.log(f"Peer didn't acknowledge packet index {self.packetIndex}")
+        return False
+
+    # -- Windowed, serial_window_send() and serial_window_ready() --
+
+    def linkIndex(self, link: int, frame: int) -> int:
+        return (frame + len(self.links) - 1 - link) // len(self.links)
+
+    def queueFrame(self, link: int, packetIndex: int) -> None:
+        frame = packetIndex * len(self.links) + link - self.packetIndex
+        payload = self.chunk[frame * FRAME_SIZE:(frame + 1) * FRAME_SIZE]
+        header = struct.pack('<IH', packetIndex, len(payload))
+        crc = binascii.crc32(payload, binascii.crc32(header))
+        self.links[link].line.write(header + payload + struct.pack('<I', crc))
+
+    def fillWindow(self, link: int) -> None:
+        l = self.links[link]
+        while l.winNext < l.end and l.winNext - l.winBase < self.window:
+            l.retries[l.winNext % MAX_WINDOW] = 0
+            self.queueFrame(link, l.winNext)
+            l.winNext += 1
+
+    def pollReply(self, l: Link):
+        while len(l.reply) < REPLY_LENGTH:
+            b = l.line.recv()
+            if b is None:
+                return None
+            if not l.reply:
+                if b == ABRT:
+                    raise RuntimeError("Peer aborted the transfer")
+                if b not in (ACK, NACK):
+                    continue
+            l.reply.append(b)
+        reply = bytes(l.reply)
+        l.reply.clear()
+        return reply[0], struct.unpack_from('<I', reply, 1)[0]
+
+    def pumpLink(self, link: int) -> None:
+        l = self.links[link]
+        self.fillWindow(link)
+        reply = self.pollReply(l)
+        if reply is None:
+            if l.line.busy():
+                l.waitStart = time.monotonic()
+            elif time.monotonic() - l.waitStart >= REPLY_TIMEOUT:
+                l.waitStart = time.monotonic()
+                l.timeouts += 1
+                if l.timeouts == MAX_RETRIES:
+                    raise RuntimeError("No acknowledgment received from serial")
+                self.retransmissions += 1
+                self.queueFrame(link, l.winBase)
+            return
+        kind, packetIndex = reply
+        if kind == ACK:
+            if packetIndex > l.winBase:
+                l.winBase = min(packetIndex, l.winNext)
+                l.waitStart = time.monotonic()
+                l.timeouts = 0
+        elif l.winBase <= packetIndex < l.winNext:
+            self.nacks += 1
+            l.retries[packetIndex % MAX_WINDOW] += 1
+            if l.retries[packetIndex % MAX_WINDOW] == MAX_RETRIES * self.window:
+                raise RuntimeError("Maximum retries reached for retransmission on medium")
+            self.retransmissions += 1
+            self.queueFrame(link, packetIndex)
+
+    def sendWindowed(self, chunk: bytes) -> bool:
+        self.chunk = chunk
+        numFrames = (len(chunk) + FRAME_SIZE - 1) // FRAME_SIZE
+        for i, l in enumerate(self.links):
+            l.winBase = self.linkIndex(i, self.packetIndex)
+            l.winNext = l.winBase
+            l.end = self.linkIndex(i, self.packetIndex + numFrames)
+            l.timeouts = 0
+            l.waitStart = time.monotonic()
+        try:
+            while any(l.winBase != l.end for l in self.links):
+                for i, l in enumerate(self.links):
+                    if l.winBase != l.end:
+                        self.pumpLink(i)
+                time.sleep(TICK / 10)
+        except RuntimeError as e:
+            self.log(str(e))
+            return False
+        self.packetIndex += numFrames
+        return True
+
+    def send(self) -> bool:
+        chunkSize = CHUNK_SECTORS * SECTOR_SIZE
+        for line in (l.line for l in self.links):
+            line.noisy = True
+        for offset in range(self.startSector * SECTOR_SIZE, len(self.image), chunkSize):
+            chunk = self.image[offset:offset + chunkSize]
+            if self.protocol == PROTO_STOP_AND_WAIT:
+                ok = self.sendChunk(chunk)
+            else:
+                ok = self.sendWindowed(chunk)
+            if not ok:
+                return False
+        for line in (l.line for l in self.links):
+            line.noisy = False
+        return True
+
+    def sendHash(self) -> bool:
+        # Like serial_medium_done(), a retransmitted frame might still be
+        # going out ahead of the footer
+        line = self.links[0].line
+        digest = hashlib.md5(self.image).hexdigest().upper().encode()
+        line.write(HEADER_MAGIC + bytes([HASH_MD5]))
+        if line.recvExact(1, 10) != bytes([ACK]):
+            self.log("Peer didn't acknowledge the footer")
+            return False
+        line.write(digest + struct.pack('<I', binascii.crc32(digest)))
+        line.drain()
+        return True
+
+
+def makeImage(size: int) -> bytes:
+    # Some of it random, some of it empty like most disks
+    rng = random.Random(size)
+    image = bytearray()
+    while len(image) < size:
+        if rng.random() < 0.5:
+            image += rng.randbytes(64 * SECTOR_SIZE)
+        else:
+            image += bytes(64 * SECTOR_SIZE)
+    return bytes(image[:size])
+
+
+def main(args) -> int:
+    size = args.size - args.size % SECTOR_SIZE
+    image = makeImage(size)
+    if not 1 <= args.ports <= MAX_SERIAL_PORTS:
+        print(f"FAILED: DISKDUMP can only use 1 to {MAX_SERIAL_PORTS} ports")
+        return 1
+    if args.ports > 1 and not args.window:
+        print("FAILED: more than one port needs a window")
+        return 1
+    lines = [Line(args.speed, args.ber) for _ in range(args.ports)]
+    sender = Sender(lines, args.speed, args.window, image)
+
+    with tempfile.TemporaryDirectory() as tmp:
+        output = os.path.join(tmp, "loopback.img")
+        receiver = subprocess.Popen([sys.executable, RECEIVER, "--no-resume", "--output", output, "--port"] + [line.device for line in lines])
+        # Let the receiver open the ports before anything goes out
+        time.sleep(2)
+        ok = sender.handshake()
+        start = time.monotonic()
+        ok = ok and sender.send()
+        elapsed = time.monotonic() - start
+        ok = ok and sender.sendHash()
+        status = receiver.wait()
+
+        if not ok or status != 0:
+            print(f"FAILED: sender {'ok' if ok else 'failed'}, receiver exited with {status}")
+            return 1
+        with open(output, "rb") as f:
+            if f.read() != image:
+                print("FAILED: the received image doesn't match")
+                return 1
+
+    sent = size - sender.startSector * SECTOR_SIZE
+    lineRate = len(lines) * args.speed / BITS_PER_BYTE_SERIAL
+    print("")
+    print(f"Image matches, {sent} bytes in {elapsed:.1f}s: {sent / elapsed:.0f} B/s, {100 * sent / elapsed / lineRate:.1f}% of the line rate of {len(lines)} x {args.speed} bps")
+    print(f"Bit errors: {sum(line.bitErrors for line in lines)}, NACKs: {sender.nacks}, retransmissions: {sender.retransmissions}")
+    return 0
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Runs the receiver against a simulated DISKDUMP over a pty")
+    parser.add_argument("--size", type=int, default=256 * 1024, help="Size of the test image in bytes (Default: 256 KB)")
+    parser.add_argument("--speed", type=int, default=115200, choices=sorted(SPEEDS), help="Line speed in bps (Default: 115200)")
+    parser.add_argument("--window", type=int, default=DEFAULT_WINDOW, help="Frames in flight like /W, 0 for stop-and-wait (Default: 16)")
+    parser.add_argument("--ports", type=int, default=1, help="Ports to split the frames across like /S COM1,COM2 (Default: 1)")
+    parser.add_argument("--ber", type=float, default=0, help="Probability of flipping each bit sent to the receiver (Default: 0)")
+    exit(main(parser.parse_args()))
@@ -1,12 +1,15 @@
 import argparse
 import binascii
-from dataclasses import dataclass
+from dataclasses import asdict, dataclass
 import hashlib
+import json
 import logging
 import math
+import os
 import serial
 import struct
 import sys
+import threading
 import time
 
 import alive_progress
@@ -17,9 +20,44 @@ ACK = b'\x55'   # 01010101
 NACK = b'\xAA'  # 10101010
 ABRT = b'\xCC'  # 11001100
 
+PROTO_STOP_AND_WAIT = 0
+PROTO_WINDOWED = 1
+PROTO_STRIPED = 2  # Windowed, split across several ports
+PROTO_SHIFT = 4
+LINK_SHIFT = 4
+MAX_WINDOW = 32  # Largest window we tell DISKDUMP we can do
+
+FRAME_HEADER_LENGTH = 6  # packet index + payload length
+FRAME_PARAMS_LENGTH = 4  # window + frame size + flags
+FRAME_FLAG_ENCODED = 1
+BITS_PER_BYTE_SERIAL = 10  # 8N1
+
+# Encoded record types, see ENCODE.H
+ENC_RAW = 0
+ENC_FILL = 1
+ENC_RLE = 2
+ENC_FILL_HEADER_LENGTH = 4
+ENC_RLE_HEADER_LENGTH = 3
+
+# Every window of this many sectors that makes it to the image gets its
+# SHA-256 saved in <image>.manifest, so an interrupted dump can carry on
+# from the last window that still checks out
+MANIFEST_SUFFIX = ".manifest"
+MANIFEST_WINDOW_SECTORS = 2048
+
 SERIAL_TIMEOUT = 10
+LINK_POLL_INTERVAL = 0.01
+HASH_BLOCK_SIZE = 1024 * 1024
 DEFAULT_SPEED = 1200
 MAX_RETRIES = 3
+# Once the image is complete, DISKDUMP may still be retransmitting on
+# some link because an ACK got lost, and only sends the footer after
+# that has been sorted out
+FOOTER_TIMEOUT = SERIAL_TIMEOUT * MAX_RETRIES
+# DISKDUMP doesn't tell us when it gives up, it just goes quiet. Reading
+# around bad sectors with drive resets can keep it quiet for a while too,
+# but a link that hasn't seen a single byte in this long is dead.
+IDLE_TIMEOUT = SERIAL_TIMEOUT * 6
 DEFAULT_OUTPUT_PATH = "disk.img"
 
 SPEEDS = {
@@ -33,32 +71,63 @@ SPEEDS = {
     7: 115200,
 }
 
-def calcHashNone(path: str, expected: str) -> bool:
-    logger.info("No hash provided")
-    return True
+HASHES = {
+    0: (0, None),
+    1: (32, "md5"),
+    2: (40, "sha1"),
+    3: (64, "sha256")
+}
 
 
-def calcHashMD5(path: str, expected: str) -> bool:
-    logger.info(f"Hash is MD5 = {expected}")
-    return hashlib.md5(open(path, 'rb').read()).hexdigest().upper() == expected
+class StreamHash:
+    # Which hash DISKDUMP used only comes in the footer, after the data,
+    # so all of them are kept going as the image is written
+    def __init__(self):
+        self.hashes = {name: hashlib.new(name) for _, name in HASHES.values() if name}
 
+    def update(self, data: bytes) -> None:
+        for h in self.hashes.values():
+            h.update(data)
 
-def calcHashSHA1(path: str, expected: str) -> bool:
-    logger.info(f"Hash is SHA1 = {expected}")
-    return hashlib.sha1(open(path, 'rb').read()).hexdigest().upper() == expected
+    def updateZeros(self, length: int) -> None:
+        block = bytes(min(length, HASH_BLOCK_SIZE))
+        while length > 0:
+            self.update(block[:length])
+            length -= len(block)
 
+    def hexdigest(self, name: str) -> str:
+        return self.hashes[name].hexdigest().upper()
 
-def calcHashSHA256(path: str, expected: str) -> bool:
-    logger.info(f"Hash is SHA256 = {expected}")
-    return hashlib.sha256(open(path, 'rb').read()).hexdigest().upper() == expected
 
+class HashingWriter:
+    # Goes in front of the image file and hashes whatever is written.
+    # Holes left by seeking forward read back as zeros, so they're hashed
+    # as such.
+    def __init__(self, f, streamHash: StreamHash):
+        self.f = f
+        self.streamHash = streamHash
+
+    def write(self, data: bytes) -> None:
+        self.f.write(data)
+        self.streamHash.update(data)
+
+    def seek(self, offset: int, whence: int) -> None:
+        self.f.seek(offset, whence)
+        self.streamHash.updateZeros(offset)
+
+
+def hashImagePrefix(path: str, length: int, streamHash: StreamHash) -> None:
+    # What's already in the image when resuming never goes through the
+    # writer
+    with open(path, "rb") as f:
+        while length > 0:
+            data = f.read(min(length, HASH_BLOCK_SIZE))
+            if not data:
+                break
+            streamHash.update(data)
+            length -= len(data)
+    streamHash.updateZeros(length)
 
-HASHES = {
-    0: (0, calcHashNone),
-    1: (32, calcHashMD5),
-    2: (40, calcHashSHA1),
-    3: (64, calcHashSHA256)
-}
 
 # Globals
 logger = None
@@ -71,13 +140,413 @@ class DiskInfo:
     sectorSize: int
     numSectors: int
 
-def recvDiskData(ser: serial.Serial, speed: int, diskInfo: DiskInfo, path: str) -> bool:
-    remainingBytes = diskInfo.sectorSize * diskInfo.numSectors
+
+@dataclass
+class FrameParams:
+    window: int
+    frameSize: int
+    flags: int
+
+
+def unpackBits(data: bytes, length: int) -> bytes:
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        n = data[i]
+        i += 1
+        if n < 128:
+            out += data[i:i + n + 1]
+            i += n + 1
+        elif n > 128:
+            out += bytes([data[i]]) * (257 - n)
+            i += 1
+    if len(out) != length:
+        raise ValueError(f"RLE record decoded to {len(out)} bytes, expected {length}")
+    return bytes(out)
+
+
+class RecordDecoder:
+    # Records can be split across frames, so keep whatever is left of
+    # the last one until the next frame arrives
+    def __init__(self, f, sectorSize: int):
+        self.f = f
+        self.sectorSize = sectorSize
+        self.buffer = bytearray()
+
+    def recordLength(self) -> int:
+        kind = self.buffer[0]
+        if kind == ENC_RAW:
+            return 1 + self.sectorSize
+        if kind == ENC_FILL:
+            return ENC_FILL_HEADER_LENGTH
+        if kind == ENC_RLE:
+            if len(self.buffer) < ENC_RLE_HEADER_LENGTH:
+                return ENC_RLE_HEADER_LENGTH
+            return ENC_RLE_HEADER_LENGTH + struct.unpack_from('<H', self.buffer, 1)[0]
+        raise ValueError(f"Unknown record type {kind}")
+
+    def feed(self, data: bytes) -> int:
+        decoded = 0
+        self.buffer += data
+        while self.buffer:
+            length = self.recordLength()
+            if len(self.buffer) < length:
+                break
+            record = bytes(self.buffer[:length])
+            del self.buffer[:length]
+            if record[0] == ENC_RAW:
+                self.f.write(record[1:])
+                decoded += self.sectorSize
+            elif record[0] == ENC_FILL:
+                fill, count = struct.unpack_from('<BH', record, 1)
+                if fill == 0:
+                    # Leave a hole, the file is truncated to size at the end
+                    self.f.seek(count * self.sectorSize, 1)
+                else:
+                    self.f.write(bytes([fill]) * (count * self.sectorSize))
+                decoded += count * self.sectorSize
+            else:
+                self.f.write(unpackBits(record[ENC_RLE_HEADER_LENGTH:], self.sectorSize))
+                decoded += self.sectorSize
+        return decoded
+
+
+class Manifest:
+    def __init__(self, path: str, diskInfo: dict, windowSectors: int, windows: list):
+        self.path = path
+        self.diskInfo = diskInfo
+        self.windowSectors = windowSectors
+        self.windows = windows
+
+    @classmethod
+    def load(cls, imgPath: str):
+        path = imgPath + MANIFEST_SUFFIX
+        try:
+            with open(path, "r") as f:
+                data = json.load(f)
+            return cls(path, data["diskInfo"], data["windowSectors"], data["windows"])
+        except (OSError, ValueError, KeyError):
+            return None
+
+    def save(self) -> None:
+        # Never leave a half written manifest behind
+        tmpPath = self.path + ".tmp"
+        with open(tmpPath, "w") as f:
+            json.dump({"diskInfo": self.diskInfo, "windowSectors": self.windowSectors, "windows": self.windows}, f)
+            f.flush()
+            os.fsync(f.fileno())
+        os.replace(tmpPath, self.path)
+
+    def delete(self) -> None:
+        if os.path.exists(self.path):
+            os.remove(self.path)
+
+    def windowBytes(self) -> int:
+        return self.windowSectors * self.diskInfo["sectorSize"]
+
+    def addWindow(self, imgPath: str) -> None:
+        self.windows.append(hashWindow(imgPath, len(self.windows), self.windowBytes()))
+        self.save()
+
+    def verify(self, imgPath: str) -> None:
+        # Drop every window from the first one that doesn't match what's
+        # in the image
+        for i, expected in enumerate(self.windows):
+            if hashWindow(imgPath, i, self.windowBytes()) != expected:
+                logger.warning(f"Window {i} of {imgPath} doesn't match the manifest")
+                del self.windows[i:]
+                break
+
+
+def hashWindow(imgPath: str, index: int, windowBytes: int) -> str:
+    with open(imgPath, "rb") as f:
+        f.seek(index * windowBytes)
+        data = f.read(windowBytes)
+    # Zero runs at the end may only be holes so far
+    return hashlib.sha256(data.ljust(windowBytes, b'\x00')).hexdigest()
+
+
+def loadResumeManifest(imgPath: str):
+    # The manifest is checked before the peer connects, hashing the
+    # image can take longer than the peer will wait for a reply
+    manifest = Manifest.load(imgPath)
+    if manifest is None:
+        return None
+    if not os.path.exists(imgPath):
+        manifest.delete()
+        return None
+    manifest.verify(imgPath)
+    logger.info(f"Found a manifest for {imgPath} with {len(manifest.windows)} good windows")
+    return manifest
+
+
+def getResumeSector(manifest, diskInfo: DiskInfo) -> int:
+    if manifest is None or manifest.diskInfo != asdict(diskInfo) or manifest.windowSectors != MANIFEST_WINDOW_SECTORS:
+        return 0
+    return min(len(manifest.windows) * manifest.windowSectors, diskInfo.numSectors)
+
+
+def logThroughput(numBytes: int, elapsed: float, speed: int, numLinks: int = 1) -> None:
+    if elapsed <= 0:
+        return
+    bytesPerSec = numBytes / elapsed
+    lineRate = numLinks * speed / BITS_PER_BYTE_SERIAL
+    logger.info(f"Received {numBytes} bytes in {elapsed:.1f}s: {bytesPerSec:.0f} B/s ({100 * bytesPerSec / lineRate:.1f}% of line rate)")
+
+
+def sendReply(ser: serial.Serial, reply: bytes, packetIndex: int) -> None:
+    ser.write(reply + struct.pack('<I', packetIndex))
+
+
+def resync(ser: serial.Serial) -> None:
+    # Whatever is in flight right now can't be trusted to be aligned to
+    # a frame, drop it and let the sender retransmit what we ask for
+    time.sleep(0.1)
+    ser.reset_input_buffer()
+
+
+class Reassembly:
+    # Frames from every link end up here and go into the image in order.
+    # Frame N of the dump is sent on link N % numLinks, as that link's
+    # packet N // numLinks.
+    def __init__(self, f, writer: HashingWriter, numLinks: int, diskInfo: DiskInfo, encoded: bool, resumeOffset: int, manifest: Manifest, path: str, bar):
+        self.f = f
+        self.writer = writer
+        self.numLinks = numLinks
+        self.totalBytes = diskInfo.sectorSize * diskInfo.numSectors
+        self.remainingBytes = self.totalBytes - resumeOffset
+        self.encoded = encoded
+        self.decoder = RecordDecoder(writer, diskInfo.sectorSize)
+        self.manifest = manifest
+        self.path = path
+        self.bar = bar
+        self.wireBytes = 0
+        self.expected = 0
+        self.pending = {}
+        self.lock = threading.Lock()
+        self.done = threading.Event()
+        self.failed = threading.Event()
+        # The links carry on until the footer turns up on the first one
+        self.finished = threading.Event()
+        self.footerMsg = b''
+        self.doneAt = None
+
+    def stopped(self) -> bool:
+        return self.finished.is_set() or self.failed.is_set()
+
+    def add(self, link: int, packetIndex: int, payload: bytes) -> None:
+        with self.lock:
+            frame = packetIndex * self.numLinks + link
+            if frame >= self.expected:
+                self.pending[frame] = payload
+
+            while self.expected in self.pending:
+                payload = self.pending.pop(self.expected)
+                self.wireBytes += len(payload)
+                if self.encoded:
+                    decodedBytes = self.decoder.feed(payload)
+                else:
+                    self.writer.write(payload)
+                    decodedBytes = len(payload)
+                self.bar(decodedBytes)
+                self.remainingBytes -= decodedBytes
+                self.expected += 1
+
+            received = self.totalBytes - self.remainingBytes
+            if (len(self.manifest.windows) + 1) * self.manifest.windowBytes() <= received:
+                self.f.flush()
+                os.fsync(self.f.fileno())
+                while (len(self.manifest.windows) + 1) * self.manifest.windowBytes() <= received:
+                    self.manifest.addWindow(self.path)
+
+            if self.remainingBytes <= 0 and not self.done.is_set():
+                self.doneAt = time.monotonic()
+                self.done.set()
+
+
+def readExact(ser: serial.Serial, length: int, reassembly: Reassembly, timeout: float = SERIAL_TIMEOUT) -> bytes:
+    # Only takes what has already arrived, so a link gives up as soon as
+    # the others have finished or failed
+    data = b''
+    deadline = time.monotonic() + timeout
+    while len(data) < length and time.monotonic() < deadline:
+        waiting = ser.in_waiting
+        if reassembly.stopped():
+            break
+        if waiting:
+            data += ser.read(min(waiting, length - len(data)))
+        else:
+            time.sleep(LINK_POLL_INTERVAL)
+    return data
+
+
+def recvLink(ser: serial.Serial, link: int, params: FrameParams, reassembly: Reassembly) -> None:
+    # Packet indices, retries and NACKs are all per link, each one runs
+    # its own window.
+    #
+    # Once the image is complete, DISKDUMP only sends the footer when
+    # every link has had its last frames acknowledged. If one of those
+    # ACKs got lost, the frame comes again and has to be acknowledged
+    # again, so every link keeps going until the footer arrives. The
+    # first link is the one the footer comes on.
+    maxRetries = MAX_RETRIES * params.window
+    retries_left = maxRetries
+    expected = 0
+    lastNack = None
+    pending = set()
+    lastHeard = time.monotonic()
+    carry = b''
+    hunting = False
+
+    while not reassembly.stopped():
+        done = reassembly.done.is_set()
+        if retries_left == 0:
+            logger.error(f"No more retries left on link {link}. Aborting transfer.")
+            reassembly.failed.set()
+            return
+
+        header = carry + readExact(ser, FRAME_HEADER_LENGTH - len(carry), reassembly, FOOTER_TIMEOUT if done else SERIAL_TIMEOUT)
+        if reassembly.stopped():
+            return
+        if done and link == 0 and header == HEADER_MAGIC[:FRAME_HEADER_LENGTH].encode():
+            reassembly.footerMsg = header + readExact(ser, len(HEADER_MAGIC) + 1 - FRAME_HEADER_LENGTH, reassembly)
+            reassembly.finished.set()
+            return
+        if len(header) > len(carry):
+            lastHeard = time.monotonic()
+        carry = b''
+        if len(header) != FRAME_HEADER_LENGTH:
+            if done and link == 0:
+                logger.error("Timed out waiting for the footer")
+                reassembly.finished.set()
+                return
+            if not done and time.monotonic() - lastHeard >= IDLE_TIMEOUT:
+                logger.error(f"Nothing received on link {link} for {IDLE_TIMEOUT}s, DISKDUMP must have given up. Aborting transfer.")
+                reassembly.failed.set()
+                return
+            if not done:
+                logger.error(f"Timed out waiting for packet {expected} on link {link}")
+                retries_left -= 1
+                resync(ser)
+                sendReply(ser, NACK, expected)
+            continue
+
+        packetIndex, payloadLength = struct.unpack('<IH', header)
+        if not 0 < payloadLength <= params.frameSize or not (expected - params.window <= packetIndex < expected + params.window):
+            # The next good frame starts somewhere after this, look for
+            # it a byte at a time. Dropping what's in flight and asking
+            # for it again only lands in the middle of the next frame
+            # while the line is busy. Whatever gets skipped shows up as a
+            # gap and is asked for then.
+            if not hunting:
+                logger.error(f"Lost frame sync waiting for packet {expected} on link {link}")
+                hunting = True
+            carry = header[1:]
+            continue
+        hunting = False
+
+        payload = readExact(ser, payloadLength, reassembly)
+        payloadCRC = readExact(ser, 4, reassembly)
+        if reassembly.stopped():
+            return
+        if len(payload) != payloadLength or len(payloadCRC) != 4:
+            logger.error(f"Timed out receiving packet {packetIndex} on link {link}")
+            resync(ser)
+            if done:
+                sendReply(ser, ACK, expected)
+            else:
+                retries_left -= 1
+                sendReply(ser, NACK, expected)
+            continue
+
+        if not checkCRC(payload, struct.unpack('<I', payloadCRC)[0], binascii.crc32(header)):
+            logger.error(f"CRC mismatch for packet {packetIndex} on link {link}")
+            if done:
+                # It can only be one we already have
+                sendReply(ser, ACK, expected)
+                continue
+            sendReply(ser, NACK, packetIndex)
+            if packetIndex == expected:
+                # Only the frame holding everything back uses up retries,
+                # the same way DISKDUMP counts them for each frame
+                retries_left -= 1
+                lastNack = expected
+            continue
+
+        if packetIndex >= expected:
+            reassembly.add(link, packetIndex, payload)
+            pending.add(packetIndex)
+        while expected in pending:
+            pending.remove(expected)
+            expected += 1
+            retries_left = maxRetries
+
+        if pending and lastNack != expected:
+            # Something before these went missing, ask for it once and
+            # keep the rest until it's here
+            sendReply(ser, NACK, expected)
+            lastNack = expected
+        else:
+            sendReply(ser, ACK, expected)
+
+
+def recvLinkThread(ser: serial.Serial, link: int, params: FrameParams, reassembly: Reassembly) -> None:
+    try:
+        recvLink(ser, link, params, reassembly)
+    except Exception:
+        logger.exception(f"Error receiving on link {link}")
+        reassembly.failed.set()
+
+
+def recvDiskDataWindowed(links: list, speed: int, diskInfo: DiskInfo, params: FrameParams, path: str, manifest: Manifest, resumeSector: int, streamHash: StreamHash) -> tuple:
+    # Returns whether it worked, and the footer, which the first link
+    # picks up
+    totalBytes = diskInfo.sectorSize * diskInfo.numSectors
+    resumeOffset = resumeSector * diskInfo.sectorSize
+    logger.info(f"Receiving data for disk with length {totalBytes} bytes, window of {params.window} frames of {params.frameSize} bytes")
+    if len(links) > 1:
+        logger.info(f"Frames are split across {len(links)} ports")
+    if resumeOffset:
+        logger.info(f"Resuming from sector {resumeSector}, {totalBytes - resumeOffset} bytes left")
+        hashImagePrefix(path, resumeOffset, streamHash)
+    start = time.monotonic()
+
+    with open(path, "r+b" if resumeOffset else "wb") as f:
+        f.seek(resumeOffset)
+        f.truncate()
+        with alive_progress.alive_bar(totalBytes, bar='classic', spinner='triangles') as bar:
+            bar(resumeOffset)
+            reassembly = Reassembly(f, HashingWriter(f, streamHash), len(links), diskInfo, params.flags & FRAME_FLAG_ENCODED, resumeOffset, manifest, path, bar)
+            threads = [threading.Thread(target=recvLinkThread, args=(ser, link, params, reassembly)) for link, ser in enumerate(links)]
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+
+            if not reassembly.done.is_set():
+                for ser in links:
+                    ser.write(ABRT)
+                return False, b''
+
+        # Zero runs at the end of the disk are only holes so far
+        f.truncate(totalBytes)
+
+    if reassembly.encoded and reassembly.wireBytes:
+        logger.info(f"Received {reassembly.wireBytes} encoded bytes ({(totalBytes - resumeOffset) / reassembly.wireBytes:.2f}:1)")
+    logThroughput(totalBytes - resumeOffset, reassembly.doneAt - start, speed, len(links))
+    return True, reassembly.footerMsg
+
+
+def recvDiskData(ser: serial.Serial, speed: int, diskInfo: DiskInfo, path: str, streamHash: StreamHash) -> bool:
+    totalBytes = diskInfo.sectorSize * diskInfo.numSectors
+    remainingBytes = totalBytes
     logger.info(f"Receiving data for disk with length {remainingBytes} bytes")
     retries_left = MAX_RETRIES
     success = False
+    start = time.monotonic()
 
     with open(path, "wb") as f:
+        f = HashingWriter(f, streamHash)
         with alive_progress.alive_bar(remainingBytes, bar='classic', spinner='triangles') as bar:
             currentPacket = 0
             while remainingBytes != 0:
@@ -111,15 +580,16 @@ def recvDiskData(ser: serial.Serial, speed: int, diskInfo: DiskInfo, path: str)
                 currentPacket += 1
                 success = False
 
+    logThroughput(totalBytes, time.monotonic() - start, speed)
     return True
 
 
-def checkCRC(data: bytes, expected: int) -> bool:
-    crc = binascii.crc32(data)
+def checkCRC(data: bytes, expected: int, crc: int = 0) -> bool:
+    crc = binascii.crc32(data, crc)
     return crc == expected
 
 
-def verifyImage(ser: serial.Serial, hash: int, path: str) -> bool:
+def verifyImage(ser: serial.Serial, hash: int, streamHash: StreamHash) -> bool:
     retries_left = MAX_RETRIES
     success = False
 
@@ -127,7 +597,7 @@ def verifyImage(ser: serial.Serial, hash: int, path: str) -> bool:
         logger.error("Invalid hash requested")
         return False
 
-    hashLength, hashFunc = HASHES[hash]
+    hashLength, hashName = HASHES[hash]
 
     while retries_left != 0 and not success:
         success = False
@@ -146,18 +616,69 @@ def verifyImage(ser: serial.Serial, hash: int, path: str) -> bool:
         ser.write(ABRT)
         return False
 
-    return hashFunc(path, expectedHash.decode("UTF-8"))
+    if hashName is None:
+        logger.info("No hash provided")
+        return True
 
+    expectedHash = expectedHash.decode("UTF-8")
+    logger.info(f"Hash is {hashName.upper()} = {expectedHash}")
+    return streamHash.hexdigest(hashName) == expectedHash
 
-def changeSerialSpeed(oldSerial: serial.Serial, device: str, speed: int) -> serial.Serial:
+
+def changeSerialSpeed(oldSerials: list, devices: list, speed: int) -> list:
     logger.info(f"Changing to speed: {speed} bps")
-    oldSerial.close()
-    newSerial = serial.Serial(device, speed, timeout=SERIAL_TIMEOUT)
+    for ser in oldSerials:
+        ser.close()
+    newSerials = [serial.Serial(device, speed, timeout=SERIAL_TIMEOUT) for device in devices]
 
     # Allow peer some time to change speed and prepare for ACK
     time.sleep(3)
 
-    return newSerial
+    return newSerials
+
+
+def recvHeader(ser: serial.Serial, device: str):
+    # first packet: DISKDUMPx where the low nibble of x is speed, either
+    # 1200, 2400, 4800, 9600, 115200 bps, and the high nibble is the
+    # protocol: 0 for stop-and-wait, 1 for windowed, 2 for windowed split
+    # across ports. The last one adds a byte with the link number in the
+    # low nibble and the number of links in the high one.
+    #
+    # Anything but stop-and-wait gets an answer right away, at this speed:
+    # ACK and the largest window we can do, or NACK if we don't know the
+    # protocol, and DISKDUMP sends the stop-and-wait header instead.
+    logger.info(f"Listening to {device}")
+    while True:
+        headerMsg = ser.read(len(HEADER_MAGIC) + 1)
+        header = headerMsg[:len(HEADER_MAGIC)].decode("UTF-8", errors="replace")
+        if (header != HEADER_MAGIC):
+            logger.error(f"Invalid header on {device}: {header}")
+            return None
+
+        protocol = headerMsg[len(HEADER_MAGIC)] >> PROTO_SHIFT
+        if (protocol in (PROTO_STOP_AND_WAIT, PROTO_WINDOWED, PROTO_STRIPED)):
+            break
+        logger.warning(f"Unsupported protocol requested: {protocol}, asking for stop-and-wait")
+        ser.write(NACK)
+
+    speed = headerMsg[len(HEADER_MAGIC)] & ((1 << PROTO_SHIFT) - 1)
+    if (speed not in SPEEDS):
+        logger.error(f"Invalid speed requested: {speed}")
+        return None
+
+    link, numLinks = 0, 1
+    if (protocol == PROTO_STRIPED):
+        linkMsg = ser.read(1)
+        if len(linkMsg) != 1:
+            logger.error(f"Timed out waiting for the link number on {device}")
+            return None
+        link = linkMsg[0] & ((1 << LINK_SHIFT) - 1)
+        numLinks = linkMsg[0] >> LINK_SHIFT
+
+    if (protocol != PROTO_STOP_AND_WAIT):
+        ser.write(ACK + bytes([MAX_WINDOW]))
+
+    return protocol, SPEEDS[speed], link, numLinks
 
 
 def recvDiskInfo(ser: serial.Serial) -> DiskInfo:
@@ -167,6 +688,12 @@ def recvDiskInfo(ser: serial.Serial) -> DiskInfo:
     return diskInfo
 
 
+def recvFrameParams(ser: serial.Serial) -> FrameParams:
+    paramsRaw = ser.read(FRAME_PARAMS_LENGTH)
+    window, frameSize, flags = struct.unpack('<BHB', paramsRaw)
+    return FrameParams(window, frameSize, flags)
+
+
 def printDiskInfo(diskInfo: DiskInfo) -> None:
     print("== DISK INFO ==")
     print(f"Cylinders:\t\t {diskInfo.numCylinders}")
@@ -176,36 +703,61 @@ def printDiskInfo(diskInfo: DiskInfo) -> None:
     print(f"Total Sectors:\t\t {diskInfo.numSectors}")
 
 
-def main(device: str, imgPath: str) -> int:
+def main(devices: list, imgPath: str, resume: bool) -> int:
     logger.info(f"Dumping data to {imgPath}")
-    with serial.Serial(device, DEFAULT_SPEED) as ser:
-        # first packet: DISKDUMPx where x is speed, either 1200, 2400, 4800, 9600, 115200 bps
-        logger.info(f"Listening to {device}")
-        headerMsg = ser.read(len(HEADER_MAGIC) + 1)
-        header = headerMsg[:len(HEADER_MAGIC)].decode("UTF-8")
-        if (header != HEADER_MAGIC):
-            logger.error(f"Invalid header: {header}")
+    manifest = None
+    if resume:
+        manifest = loadResumeManifest(imgPath)
+    serials = [serial.Serial(device, DEFAULT_SPEED) for device in devices]
+    try:
+        headers = [recvHeader(ser, device) for ser, device in zip(serials, devices)]
+        if None in headers:
             return 1
 
-        speed = headerMsg[len(HEADER_MAGIC)]
-        if (speed not in SPEEDS):
-            logger.error(f"Invalid speed requested: {speed}")
+        protocol, speed, _, numLinks = headers[0]
+        if any(h[0] != protocol or h[1] != speed or h[3] != numLinks for h in headers):
+            logger.error("The ports don't agree on the protocol and speed")
+            return 1
+        if numLinks != len(devices) or sorted(h[2] for h in headers) != list(range(numLinks)):
+            logger.error(f"DISKDUMP is sending over {numLinks} ports, listening to {len(devices)}")
             return 1
 
-        speed = SPEEDS[speed]
+        # Keep the ports in link order, whatever order they were given in
+        order = sorted(range(len(devices)), key=lambda i: headers[i][2])
+        devices = [devices[i] for i in order]
 
-        ser = changeSerialSpeed(ser, device, speed)
-        ser.write(ACK)
+        serials = changeSerialSpeed(serials, devices, speed)
+        for ser in serials:
+            ser.write(ACK)
+        ser = serials[0]
 
-        # second packet: serialised disk info (18 bytes)
+        # second packet: serialised disk info (18 bytes), followed by the
+        # window and frame size (3 bytes) if windowed. Only on the first
+        # link when there's more than one.
         diskInfo = recvDiskInfo(ser)
-        ser.write(ACK)
+        streamHash = StreamHash()
+        if (protocol != PROTO_STOP_AND_WAIT):
+            # The ACK carries the sector the peer should start from
+            params = recvFrameParams(ser)
+            resumeSector = getResumeSector(manifest, diskInfo)
+            if resumeSector == 0:
+                manifest = Manifest(imgPath + MANIFEST_SUFFIX, asdict(diskInfo), MANIFEST_WINDOW_SECTORS, [])
+                manifest.save()
+            sendReply(ser, ACK, resumeSector)
+        else:
+            if manifest is not None:
+                logger.warning("Stop-and-wait transfers can't be resumed, starting over")
+                manifest.delete()
+            ser.write(ACK)
 
         print("")
         printDiskInfo(diskInfo)
         print("")
-        
-        ok = recvDiskData(ser, speed, diskInfo, imgPath)
+
+        if (protocol != PROTO_STOP_AND_WAIT):
+            ok, footerMsg = recvDiskDataWindowed(serials, speed, diskInfo, params, imgPath, manifest, resumeSector, streamHash)
+        else:
+            ok = recvDiskData(ser, speed, diskInfo, imgPath, streamHash)
         if (not ok):
             logger.error("Error receiving disk data")
             return 1
@@ -213,19 +765,25 @@ def main(device: str, imgPath: str) -> int:
         logger.info("Data transfer finished")
 
         # final packet: DISKDUMPx where x is hash algo None, MD5, SHA1, SHA256
-        footerMsg = ser.read(len(HEADER_MAGIC) + 1)
-        footer = footerMsg[:len(HEADER_MAGIC)].decode("UTF-8")
+        if (protocol == PROTO_STOP_AND_WAIT):
+            footerMsg = ser.read(len(HEADER_MAGIC) + 1)
+        footer = footerMsg[:len(HEADER_MAGIC)].decode("UTF-8", errors="replace")
         if (footer != HEADER_MAGIC):
             logger.error(f"Invalid footer: {footer}")
             return 1
 
         ser.write(ACK)
         hash = footerMsg[len(HEADER_MAGIC)]
-        ok = verifyImage(ser, hash, imgPath)
+        ok = verifyImage(ser, hash, streamHash)
         if (not ok):
             logger.error("Error verifying the saved image")
             return 1
         logger.info("Image verified")
+        if (protocol != PROTO_STOP_AND_WAIT):
+            manifest.delete()
+    finally:
+        for ser in serials:
+            ser.close()
 
     logger.info("Successfully received image! :)")
     return 0
@@ -237,6 +795,7 @@ if __name__ == "__main__":
 
     parser = argparse.ArgumentParser(description="Serial port listener for transfers from DISKDUMP")
     parser.add_argument("--output", type=str, default=DEFAULT_OUTPUT_PATH, help="Path to file where the data will be dumped to (Default: disk.img in current directory)")
-    parser.add_argument("--port", type=str, required=True, help="Serial port where the communication will be established")
+    parser.add_argument("--port", type=str, nargs="+", required=True, help="Serial port where the communication will be established. Give one for each port DISKDUMP was told to use with /S.")
+    parser.add_argument("--no-resume", action="store_true", help="Start over even if there's a manifest from an interrupted dump to the same output")
     args = parser.parse_args()
-    exit(main(args.port, args.output))
+    exit(main(args.port, args.output, not args.no_resume))